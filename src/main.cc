@@ -40,15 +40,19 @@ class Tagged {
   ValuesSeen * seen;
   EvalState * state;
   Value * value;
+  bool functions = true;
   Tagged(const Tagged & tagged, Value * value) : value(value) {
     seen = tagged.seen;
     state = tagged.state;
+    functions = tagged.functions;
   }
   Tagged(ValuesSeen * seen, EvalState * state, Value * value) : seen(seen), state(state), value(value) { }
 };
 
 bool isTTY = isatty(fileno(stdout));
 
+bool skipInternal = false;
+
 class Change {
   friend std::ostream & operator << (std::ostream & output, const Change & change);
   private:
@@ -225,6 +229,7 @@ void diffValues(const std::string & path, Tagged & v, Tagged & w) {
   } else if (v.value->type() == nix::nThunk) {
     if (w.value->type() == nix::nAttrs && !(w.state->isDerivation(*w.value))) {
       printAttrs(false, path, w);
+    } else if (w.value->type() == nix::nFunction && !w.functions) {
     } else {
       printChange(
         "",
@@ -234,6 +239,7 @@ void diffValues(const std::string & path, Tagged & v, Tagged & w) {
   } else if (w.value->type() == nix::nThunk) {
     if (v.value->type() == nix::nAttrs && !(v.state->isDerivation(*v.value))) {
       printAttrs(true, path, v);
+    } else if (v.value->type() == nix::nFunction && !v.functions) {
     } else {
       printChange(
         path + " = " + serializeScalar(true, v, PrintOptions {}) + ";",
@@ -272,6 +278,14 @@ void diffValues(const std::string & path, Tagged & v, Tagged & w) {
           diffStrings(path, v, w);
         }
         break;
+      case nix::nFunction:
+        if (v.functions && !equals(v, w)) {
+          printChange(
+            path + " = " + serializeScalar(true, v, PrintOptions {}) + ";",
+            path + " = " + serializeScalar(false, w, PrintOptions {}) + ";"
+          );
+        }
+        break;
       default:
         if (!equals(v, w)) {
           printChange(
@@ -363,6 +377,11 @@ void printValue(bool printDeletion, const std::string & path, Tagged & v) {
       case nix::nList:
         printList(printDeletion, path, v);
         break;
+      case nix::nFunction:
+        if (!v.functions) {
+          break;
+        }
+        [[fallthrough]];
       default:
         if (printDeletion) {
           printChange(path + " = " + serializeScalar(true, v, PrintOptions {}) + ";", "");
@@ -459,6 +478,426 @@ void diffStrings(const std::string & path, Tagged & v, Tagged & w) {
   printUniDiff(diff);
 }
 
+Value * getAttr(Tagged & v, const std::string_view & name) {
+  const Attr * x = v.value->attrs()->get(v.state->symbols.create(name));
+  return x ? x->value : nullptr;
+}
+
+Value * forceAttr(Tagged & v, const std::string_view & name) {
+  const Attr * x = v.value->attrs()->get(v.state->symbols.create(name));
+  if (!x) {
+    return nullptr;
+  }
+  v.state->forceValue(*x->value, x->pos);
+  return x->value;
+}
+
+std::vector<std::string> attrNames(Tagged & v) {
+  std::vector<std::string> names;
+  for (auto & i : *v.value->attrs()) {
+    names.emplace_back(std::string(v.state->symbols[i.name]));
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+std::vector<std::string> attrNames(Tagged & v, Tagged & w) {
+  std::vector<std::string> names = attrNames(v);
+  for (auto & name : attrNames(w)) {
+    names.emplace_back(name);
+  }
+  std::sort(names.begin(), names.end());
+  auto last = std::unique(names.begin(), names.end());
+  names.erase(last, names.end());
+  return names;
+}
+
+Tagged withFunctions(Tagged v, bool functions) {
+  v.functions = functions;
+  return v;
+}
+
+bool isPlainAttrs(Tagged & v) {
+  return v.value->type() == nix::nAttrs && !v.state->isDerivation(*v.value);
+}
+
+bool isOption(Tagged & v) {
+  if (v.value->type() != nix::nAttrs) {
+    return false;
+  }
+  Value * type = forceAttr(v, "_type");
+  return type && type->type() == nix::nString && type->string_view() == "option";
+}
+
+bool isFlagSet(Tagged & v, const std::string_view & name) {
+  Value * flag = forceAttr(v, name);
+  return flag && flag->type() == nix::nBool && flag->boolean();
+}
+
+// Options declared with `visible = false` are never shown, `internal` and
+// `readOnly` options only with --skip-internal.
+bool isHidden(Tagged & v) {
+  Value * visible = forceAttr(v, "visible");
+  if (visible && visible->type() == nix::nBool && !visible->boolean()) {
+    return true;
+  }
+  return skipInternal && (isFlagSet(v, "internal") || isFlagSet(v, "readOnly"));
+}
+
+std::string typeName(Tagged & type) {
+  if (type.value->type() != nix::nAttrs) {
+    return "";
+  }
+  Value * name = forceAttr(type, "name");
+  if (!name || name->type() != nix::nString) {
+    return "";
+  }
+  return std::string(name->string_view());
+}
+
+Value * elemType(Tagged & type) {
+  Value * nestedTypes = forceAttr(type, "nestedTypes");
+  if (!nestedTypes || nestedTypes->type() != nix::nAttrs) {
+    return nullptr;
+  }
+  Tagged t = Tagged(type, nestedTypes);
+  return forceAttr(t, "elemType");
+}
+
+// Both the type and its sub-options are rooted, so that neither is
+// collected, nor the address of the type reused, while the walk runs.
+std::map<const Value *, std::pair<nix::RootValue, nix::RootValue>> subOptionsCache;
+
+// `getSubOptions` evaluates the submodule's declarations anew on every call,
+// so the result is shared between all values of the same submodule type.
+Value * subOptions(Tagged & type) {
+  auto cached = subOptionsCache.find(type.value);
+  if (cached != subOptionsCache.end()) {
+    return *cached->second.second;
+  }
+  Value * result = nullptr;
+  Value * getSubOptions = forceAttr(type, "getSubOptions");
+  if (getSubOptions) {
+    result = type.state->allocValue();
+    type.state->callFunction(*getSubOptions, type.state->vEmptyList, *result, nix::noPos);
+    type.state->forceValue(*result, nix::noPos);
+    if (result->type() != nix::nAttrs) {
+      result = nullptr;
+    }
+  }
+  subOptionsCache[type.value] = { nix::allocRootValue(type.value), nix::allocRootValue(result) };
+  return result;
+}
+
+std::optional<std::string> drvPath(Tagged & v) {
+  if (v.value->type() != nix::nAttrs || !v.state->isDerivation(*v.value)) {
+    return std::nullopt;
+  }
+  Value * x = forceAttr(v, "drvPath");
+  if (!x || x->type() != nix::nString) {
+    return std::nullopt;
+  }
+  return std::string(x->string_view());
+}
+
+// Packages are compared by their exact drvPath. Unlike `equals`, which masks
+// store hashes, this reports rebuilds of a package whose name is unchanged, so
+// the exact drvPath is printed whenever the masked forms would coincide.
+std::string serializePackage(bool printDeletion, Tagged & v, bool exact) {
+  auto path = drvPath(v);
+  if (exact && path.has_value()) {
+    return "«derivation " + path.value() + "»";
+  }
+  return serializeScalar(printDeletion, v, printDrv);
+}
+
+void diffPackages(const std::string & path, Tagged & v, Tagged & w) {
+  auto x = drvPath(v);
+  auto y = drvPath(w);
+  if (!x.has_value() || !y.has_value()) {
+    diffValues(path, v, w);
+    return;
+  }
+  if (x.value() == y.value()) {
+    return;
+  }
+  auto exact = serializePackage(true, v, false) == serializePackage(false, w, false);
+  printChange(
+    path + " = " + serializePackage(true, v, exact) + ";",
+    path + " = " + serializePackage(false, w, exact) + ";"
+  );
+}
+
+bool isPackageList(Tagged & v) {
+  for (auto x : v.value->listItems()) {
+    if (x->type() != nix::nAttrs || !v.state->isDerivation(*x)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The order of a `listOf package` only decides which package wins a file
+// collision, so such lists are compared as multisets of drvPaths. All other
+// lists are compared by position.
+void diffPackageLists(const std::string & path, Tagged & v, Tagged & w) {
+  std::vector<std::pair<std::string, long unsigned int>> ks, ls;
+  auto xs = v.value->listItems();
+  auto ys = w.value->listItems();
+  for (long unsigned int i = 0; i < xs.size(); i++) {
+    Tagged t = Tagged(v, xs[i]);
+    ks.emplace_back(drvPath(t).value_or(""), i);
+  }
+  for (long unsigned int i = 0; i < ys.size(); i++) {
+    Tagged s = Tagged(w, ys[i]);
+    ls.emplace_back(drvPath(s).value_or(""), i);
+  }
+  std::sort(ks.begin(), ks.end());
+  std::sort(ls.begin(), ls.end());
+
+  std::vector<long unsigned int> deletions, additions;
+  auto k = ks.begin();
+  auto l = ls.begin();
+  while (k != ks.end() || l != ls.end()) {
+    if (l == ls.end() || (k != ks.end() && k->first < l->first)) {
+      deletions.emplace_back((k++)->second);
+    } else if (k == ks.end() || l->first < k->first) {
+      additions.emplace_back((l++)->second);
+    } else {
+      ++k;
+      ++l;
+    }
+  }
+  std::sort(deletions.begin(), deletions.end());
+  std::sort(additions.begin(), additions.end());
+
+  std::set<std::string> deleted, added;
+  for (auto i : deletions) {
+    Tagged t = Tagged(v, xs[i]);
+    deleted.insert(serializePackage(true, t, false));
+  }
+  for (auto i : additions) {
+    Tagged s = Tagged(w, ys[i]);
+    added.insert(serializePackage(false, s, false));
+  }
+  for (auto i : deletions) {
+    Tagged t = Tagged(v, xs[i]);
+    auto exact = added.contains(serializePackage(true, t, false));
+    printChange(appendPath(path, std::format(".{}", i)) + " = " + serializePackage(true, t, exact) + ";", "");
+  }
+  for (auto i : additions) {
+    Tagged s = Tagged(w, ys[i]);
+    auto exact = deleted.contains(serializePackage(false, s, false));
+    printChange("", appendPath(path, std::format(".{}", i)) + " = " + serializePackage(false, s, exact) + ";");
+  }
+}
+
+void diffDeclared(const std::string & path, Value * declV, Value * declW, Tagged & v, Tagged & w);
+
+void printDeclared(bool printDeletion, const std::string & path, Value * decl, Tagged & v);
+
+void printTyped(bool printDeletion, const std::string & path, Value * type, Tagged & v) {
+  if (v.value->type() == nix::nThunk) {
+    return;
+  }
+  if (v.value->type() == nix::nAttrs && v.state->isDerivation(*v.value)) {
+    if (printDeletion) {
+      printChange(path + " = " + serializeScalar(true, v, printDrv) + ";", "");
+    } else {
+      printChange("", path + " = " + serializeScalar(false, v, printDrv) + ";");
+    }
+    return;
+  }
+
+  std::string name;
+  Value * elem = nullptr;
+  if (type) {
+    Tagged t = Tagged(v, type);
+    name = typeName(t);
+    elem = elemType(t);
+  }
+
+  if (name == "listOf" && v.value->type() == nix::nList) {
+    auto xs = v.value->listItems();
+    for (long unsigned int i = 0; i < xs.size(); i++) {
+      Tagged t = Tagged(v, xs[i]);
+      printTyped(printDeletion, appendPath(path, std::format(".{}", i)), elem, t);
+    }
+  } else if ((name == "attrsOf" || name == "lazyAttrsOf") && isPlainAttrs(v)) {
+    for (auto & i : attrNames(v)) {
+      Tagged t = Tagged(v, getAttr(v, i));
+      printTyped(printDeletion, appendPath(path, i), elem, t);
+    }
+  } else if (name == "nullOr" && v.value->type() != nix::nNull) {
+    printTyped(printDeletion, path, elem, v);
+  } else if (name == "submodule" && isPlainAttrs(v)) {
+    Tagged t = Tagged(v, type);
+    printDeclared(printDeletion, path, subOptions(t), v);
+  } else if (v.value->type() == nix::nFunction && name != "functionTo") {
+  } else {
+    printValue(printDeletion, path, v);
+  }
+}
+
+void diffTyped(const std::string & path, Value * typeV, Value * typeW, Tagged & v, Tagged & w) {
+  if (v.value->type() == nix::nThunk && w.value->type() == nix::nThunk) {
+    return;
+  } else if (v.value->type() == nix::nThunk) {
+    printTyped(false, path, typeW, w);
+    return;
+  } else if (w.value->type() == nix::nThunk) {
+    printTyped(true, path, typeV, v);
+    return;
+  }
+
+  std::string nameV, nameW;
+  Value * elemV = nullptr;
+  Value * elemW = nullptr;
+  if (typeV) {
+    Tagged t = Tagged(v, typeV);
+    nameV = typeName(t);
+    elemV = elemType(t);
+  }
+  if (typeW) {
+    Tagged s = Tagged(w, typeW);
+    nameW = typeName(s);
+    elemW = elemType(s);
+  }
+
+  Tagged t = withFunctions(v, nameV == "functionTo" || nameW == "functionTo");
+  Tagged s = withFunctions(w, nameV == "functionTo" || nameW == "functionTo");
+
+  if (nameV != nameW) {
+    diffValues(path, t, s);
+  } else if (nameV == "package") {
+    diffPackages(path, t, s);
+  } else if (nameV == "listOf" && v.value->type() == nix::nList && w.value->type() == nix::nList) {
+    Tagged et = Tagged(v, elemV);
+    Tagged es = Tagged(w, elemW);
+    if (elemV && elemW && typeName(et) == "package" && typeName(es) == "package" && isPackageList(v) && isPackageList(w)) {
+      diffPackageLists(path, v, w);
+      return;
+    }
+    auto xs = v.value->listItems();
+    auto ys = w.value->listItems();
+    long unsigned int n = std::min(xs.size(), ys.size());
+    for (long unsigned int i = 0; i < n; i++) {
+      Tagged x = Tagged(v, xs[i]);
+      Tagged y = Tagged(w, ys[i]);
+      diffTyped(appendPath(path, std::format(".{}", i)), elemV, elemW, x, y);
+    }
+    for (long unsigned int i = n; i < xs.size(); i++) {
+      Tagged x = Tagged(v, xs[i]);
+      printTyped(true, appendPath(path, std::format(".{}", i)), elemV, x);
+    }
+    for (long unsigned int i = n; i < ys.size(); i++) {
+      Tagged y = Tagged(w, ys[i]);
+      printTyped(false, appendPath(path, std::format(".{}", i)), elemW, y);
+    }
+  } else if ((nameV == "attrsOf" || nameV == "lazyAttrsOf") && isPlainAttrs(v) && isPlainAttrs(w)) {
+    for (auto & name : attrNames(v, w)) {
+      Value * x = getAttr(v, name);
+      Value * y = getAttr(w, name);
+      if (x && y) {
+        Tagged tx = Tagged(v, x);
+        Tagged sy = Tagged(w, y);
+        diffTyped(appendPath(path, name), elemV, elemW, tx, sy);
+      } else if (x) {
+        Tagged tx = Tagged(v, x);
+        printTyped(true, appendPath(path, name), elemV, tx);
+      } else if (y) {
+        Tagged sy = Tagged(w, y);
+        printTyped(false, appendPath(path, name), elemW, sy);
+      }
+    }
+  } else if (nameV == "nullOr" && v.value->type() != nix::nNull && w.value->type() != nix::nNull) {
+    diffTyped(path, elemV, elemW, v, w);
+  } else if (nameV == "submodule" && isPlainAttrs(v) && isPlainAttrs(w)) {
+    Tagged tv = Tagged(v, typeV);
+    Tagged tw = Tagged(w, typeW);
+    diffDeclared(path, subOptions(tv), subOptions(tw), v, w);
+  } else {
+    diffValues(path, t, s);
+  }
+}
+
+void printDeclared(bool printDeletion, const std::string & path, Value * decl, Tagged & v) {
+  if (v.value->type() == nix::nThunk) {
+    return;
+  }
+  if (!decl) {
+    Tagged t = withFunctions(v, false);
+    printValue(printDeletion, path, t);
+    return;
+  }
+  Tagged d = Tagged(v, decl);
+  v.state->forceValue(*decl, decl->determinePos(nix::noPos));
+  if (isOption(d)) {
+    if (!isHidden(d)) {
+      printTyped(printDeletion, path, forceAttr(d, "type"), v);
+    }
+  } else if (d.value->type() == nix::nAttrs && isPlainAttrs(v)) {
+    for (auto & name : attrNames(v)) {
+      Tagged t = Tagged(v, getAttr(v, name));
+      printDeclared(printDeletion, appendPath(path, name), forceAttr(d, name), t);
+    }
+  } else {
+    Tagged t = withFunctions(v, false);
+    printValue(printDeletion, path, t);
+  }
+}
+
+// Walks `config` along the declarations in `options`, so that each option's
+// type decides how its value is compared. Like `diffValues`, values that
+// building the system did not force are skipped, and only the declarations
+// of forced values are looked at. Undeclared values, such as those of
+// freeform submodules, are compared as in `diffValues`.
+void diffDeclared(const std::string & path, Value * declV, Value * declW, Tagged & v, Tagged & w) {
+  if (v.value->type() == nix::nThunk && w.value->type() == nix::nThunk) {
+    return;
+  }
+  if (!declV || !declW) {
+    Tagged t = withFunctions(v, false);
+    Tagged s = withFunctions(w, false);
+    diffValues(path, t, s);
+    return;
+  }
+  Tagged dv = Tagged(v, declV);
+  Tagged dw = Tagged(w, declW);
+  v.state->forceValue(*declV, declV->determinePos(nix::noPos));
+  w.state->forceValue(*declW, declW->determinePos(nix::noPos));
+
+  if (isOption(dv) && isOption(dw)) {
+    if (!isHidden(dv) && !isHidden(dw)) {
+      diffTyped(path, forceAttr(dv, "type"), forceAttr(dw, "type"), v, w);
+    }
+  } else if (!isOption(dv) && !isOption(dw) && dv.value->type() == nix::nAttrs && dw.value->type() == nix::nAttrs && isPlainAttrs(v) && isPlainAttrs(w)) {
+    for (auto & name : attrNames(v, w)) {
+      Value * x = getAttr(v, name);
+      Value * y = getAttr(w, name);
+      if (x && y) {
+        Tagged t = Tagged(v, x);
+        Tagged s = Tagged(w, y);
+        diffDeclared(appendPath(path, name), forceAttr(dv, name), forceAttr(dw, name), t, s);
+      } else if (x) {
+        Tagged t = Tagged(v, x);
+        printDeclared(true, appendPath(path, name), forceAttr(dv, name), t);
+      } else if (y) {
+        Tagged s = Tagged(w, y);
+        printDeclared(false, appendPath(path, name), forceAttr(dw, name), s);
+      }
+    }
+  } else if (v.value->type() == nix::nThunk) {
+    printDeclared(false, path, declW, w);
+  } else if (w.value->type() == nix::nThunk) {
+    printDeclared(true, path, declV, v);
+  } else {
+    Tagged t = withFunctions(v, false);
+    Tagged s = withFunctions(w, false);
+    diffValues(path, t, s);
+  }
+}
+
 class BaseExpr {
   std::string string;
   public:
@@ -476,11 +915,12 @@ class FinalExpr {
     std::string to_string() {
       return string;
     };
-    FinalExpr(BaseExpr e, std::optional<std::string> rootPath) {
-      if (rootPath.has_value()) {
-        string = std::format("let inherit ({}) config system; in builtins.seq system config.{}", e.to_string(), rootPath.value());
+    FinalExpr(BaseExpr e, std::optional<std::string> rootPath, bool options) {
+      std::string suffix = rootPath.has_value() ? "." + rootPath.value() : "";
+      if (options) {
+        string = std::format("let inherit ({}) config options system; in builtins.seq system {{ config = config{}; options = options{}; }}", e.to_string(), suffix, suffix);
       } else {
-        string = std::format("let inherit ({}) config system; in builtins.seq system config", e.to_string());
+        string = std::format("let inherit ({}) config system; in builtins.seq system config{}", e.to_string(), suffix);
       }
     }
 };
@@ -492,7 +932,7 @@ class FlakeURL {
   FlakeURL(std::string path, std::string attr) : path{path}, attr{attr} {}
   std::string to_string() { return std::format("{}#{}", path, attr); }
   BaseExpr toBaseExpr() {
-    return BaseExpr(std::format("let inherit ((builtins.getFlake (toString {})).{}) config; in {{ inherit config; system = config.system.build.toplevel; }}", path, attr));
+    return BaseExpr(std::format("let inherit ((builtins.getFlake (toString {})).{}) config options; in {{ inherit config options; system = config.system.build.toplevel; }}", path, attr));
   }
 };
 
@@ -564,6 +1004,7 @@ std::filesystem::path workTree;
 
 int main(int argc, char ** argv) {
   bool expr = false;
+  bool options = false;
   std::string rev = "HEAD";
   std::optional<std::string> rootPath;
   std::optional<ConfigExpr> maybeConfig1Expr, maybeConfig2Expr;
@@ -582,6 +1023,10 @@ int main(int argc, char ** argv) {
         isTTY = true;
     } else if (*arg == "--expr") {
         expr = true;
+    } else if (*arg == "--options") {
+        options = true;
+    } else if (*arg == "--skip-internal") {
+        skipInternal = true;
     } else if (*arg == "--rev") {
         rev = nix::getArg(*arg, arg, end);
     } else if (*arg == "-p" || *arg == "--path") {
@@ -651,19 +1096,31 @@ int main(int argc, char ** argv) {
   }
   ConfigExpr config2Expr = maybeConfig2Expr.value();
 
-  FinalExpr finalExpr1 = FinalExpr(config1Expr.toBaseExpr(), rootPath);
-  FinalExpr finalExpr2 = FinalExpr(config2Expr.toBaseExpr(), rootPath);
+  FinalExpr finalExpr1 = FinalExpr(config1Expr.toBaseExpr(), rootPath, options);
+  FinalExpr finalExpr2 = FinalExpr(config2Expr.toBaseExpr(), rootPath, options);
 
   ValuesSeen seen1, seen2;
   Value value1, value2;
   Tagged config1 = parseAndEval(seen1, *state1, value1, finalExpr1.to_string(), ".");
   Tagged config2 = parseAndEval(seen2, *state2, value2, finalExpr2.to_string(), workTree.empty() ? "." : workTree);
 
+  auto diff = [&] (Tagged & v, Tagged & w) {
+    if (options) {
+      Tagged c = Tagged(v, forceAttr(v, "config"));
+      Tagged d = Tagged(w, forceAttr(w, "config"));
+      diffDeclared(rootPath.value_or(""), forceAttr(v, "options"), forceAttr(w, "options"), c, d);
+    } else {
+      diffValues(rootPath.value_or(""), v, w);
+    }
+  };
   if (workTree.empty()) {
-    diffValues(rootPath.value_or(""), config1, config2);
+    diff(config1, config2);
   } else {
-    diffValues(rootPath.value_or(""), config2, config1);
+    diff(config2, config1);
   }
 
+  state1->maybePrintStats();
+  state2->maybePrintStats();
+
   return 0;
 }
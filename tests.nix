@@ -10,12 +10,27 @@ let
   inherit (pkgs) lib;
   nixos-diff = import ./. { inherit pkgs; };
   runTest = if dontCheck then buildOutput else checkOutput;
+  # Extra command line flags are read from `args`.
+  args = name: lib.optionalString (builtins.pathExists ./tests/${name}/args) (lib.fileContents ./tests/${name}/args);
+  # In addition to `output.diff`, every line of `expect` is a string that has
+  # to occur in the output, or, prefixed with `!`, must not occur in it.
   checkOutput = name: pkgs.runCommand name { } ''
     cd ${lib.fileset.toSource {
       root = ./tests/${name};
-      fileset = lib.fileset.maybeMissing (./tests/${name}/output.diff);
+      fileset = lib.fileset.unions [
+        (lib.fileset.maybeMissing ./tests/${name}/output.diff)
+        (lib.fileset.maybeMissing ./tests/${name}/expect)
+      ];
     }}
     ${lib.optionalString (!dontCheck) "diff -u output.diff ${buildOutput name}"} >$out
+    ${lib.optionalString (builtins.pathExists ./tests/${name}/expect) ''
+      while IFS= read -r pattern; do
+        case "$pattern" in
+          !*) ! grep -qF -- "''${pattern#!}" ${buildOutput name} ;;
+          *) grep -qF -- "$pattern" ${buildOutput name} ;;
+        esac || { echo "unmet expectation: $pattern" >&2; exit 1; }
+      done <expect
+    ''}
   '';
   buildOutput = name:
     if !(lib.hasPrefix "flakes" name) then
@@ -29,7 +44,7 @@ let
           root = ./tests/${name};
           fileset = lib.fileset.difference ./tests/${name} (lib.fileset.maybeMissing ./tests/${name}/output.diff);
         }}
-        ${lib.getExe nixos-diff} ./config{1,2}.nix >$out
+        ${lib.getExe nixos-diff} ${args name} ./config{1,2}.nix >$out
       '' else
       pkgs.runCommand name
         {
@@ -70,7 +85,7 @@ let
           root = ./tests/${name};
           fileset = lib.fileset.difference ./tests/${name} (lib.fileset.maybeMissing ./tests/${name}/output.diff);
         }}
-        ${lib.getExe nixos-diff} ./1#nixosConfigurations.example ./2#nixosConfigurations.example >$out
+        ${lib.getExe nixos-diff} ${args name} ./1#nixosConfigurations.example ./2#nixosConfigurations.example >$out
       ''
   ;
 in
@@ -0,0 +1,13 @@
+{ ... }:
+{
+  imports = [ ./module.nix ];
+
+  boot.loader.grub.device = "nodev";
+  fileSystems."/".device = "tmpfs";
+  nixpkgs.hostPlatform = "x86_64-linux";
+  system.stateVersion = "25.05";
+
+  test.old = "a";
+  test.hidden = "a";
+  test.raw = name: "a ${name}";
+}
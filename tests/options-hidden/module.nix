@@ -0,0 +1,18 @@
+{ config, lib, ... }:
+{
+  imports = [
+    (lib.mkRenamedOptionModule [ "test" "old" ] [ "test" "new" ])
+  ];
+
+  options.test = {
+    new = lib.mkOption { type = lib.types.str; };
+    hidden = lib.mkOption { type = lib.types.str; visible = false; };
+    raw = lib.mkOption { type = lib.types.raw; };
+  };
+
+  config.environment.etc = {
+    test-old.text = config.test.old;
+    test-hidden.text = config.test.hidden;
+    test-raw.text = config.test.raw "world";
+  };
+}
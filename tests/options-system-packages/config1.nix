@@ -0,0 +1,9 @@
+{ pkgs, ... }:
+{
+  boot.loader.grub.device = "nodev";
+  fileSystems."/".device = "tmpfs";
+  nixpkgs.hostPlatform = "x86_64-linux";
+  system.stateVersion = "25.05";
+
+  environment.systemPackages = [ pkgs.hello pkgs.jq ];
+}